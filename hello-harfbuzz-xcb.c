@@ -1,16 +1,27 @@
 #include <alloca.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <inttypes.h>
 #include <math.h>
+#include <time.h>
+#include <errno.h>
 #include <hb.h>
 #include <hb-ft.h>
+#include <ft2build.h>
+#include FT_LCD_FILTER_H
 #include <xcb/xcb.h>
 #include <xcb/render.h>
 
 #define FONT_SIZE 36
 #define MARGIN (FONT_SIZE * .5)
+#define GLYPH_GAMMA 1.8
+#define LAYOUT_CACHE_SIZE 64
+#define ARENA_BLOCK_SIZE 4096
+#define BUFFER_POOL_SIZE 64
+#define BENCH_ITERATIONS 100000
+#define BENCH_WARMUP 16
 
 
 xcb_render_pictformat_t get_pictformat_from_visual(xcb_render_query_pict_formats_reply_t *reply, xcb_visualid_t visual);
@@ -68,21 +79,904 @@ testCookie (xcb_void_cookie_t cookie,
   }
 }
 
+/* Heap allocations made by the whole process, including inside HarfBuzz,
+ * FreeType and xcb. Once the caches are warm, drawing a string should not
+ * add to this. Counting replaces glibc's allocator entry points with
+ * wrappers, so it is only built into the benchmark binary (COUNT_ALLOCS);
+ * otherwise the count stays at zero. */
+static unsigned long alloc_count;
+
+#if defined(COUNT_ALLOCS) && defined(__GLIBC__)
+#define HAVE_ALLOC_COUNT 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void *__libc_valloc(size_t size);
+extern void *__libc_pvalloc(size_t size);
+extern void __libc_free(void *ptr);
+
+static void
+count_alloc(void)
+{
+  __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+}
+
+void *
+malloc(size_t size)
+{
+  count_alloc();
+  return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+  count_alloc();
+  return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+  count_alloc();
+  return __libc_realloc(ptr, size);
+}
+
+void *
+reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+  if (size && nmemb > SIZE_MAX / size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  count_alloc();
+  return __libc_realloc(ptr, nmemb * size);
+}
+
+void *
+memalign(size_t alignment, size_t size)
+{
+  count_alloc();
+  return __libc_memalign(alignment, size);
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+  count_alloc();
+  return __libc_memalign(alignment, size);
+}
+
+int
+posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  void *ptr;
+
+  if (alignment % sizeof (void *) || (alignment & (alignment - 1)))
+    return EINVAL;
+  count_alloc();
+  ptr = __libc_memalign(alignment, size);
+  if (!ptr)
+    return ENOMEM;
+  *memptr = ptr;
+  return 0;
+}
+
+void *
+valloc(size_t size)
+{
+  count_alloc();
+  return __libc_valloc(size);
+}
+
+void *
+pvalloc(size_t size)
+{
+  count_alloc();
+  return __libc_pvalloc(size);
+}
+
+void
+free(void *ptr)
+{
+  __libc_free(ptr);
+}
+#endif
+
+struct arena_block {
+  struct arena_block *prev;
+  size_t size;
+  size_t used;
+  uint8_t data[];
+};
+
+/* Bump allocator for transient buffers, reset once per frame. */
+struct arena {
+  struct arena_block *block;
+};
+
+static __thread struct arena frame_arena;
+
+static void *
+arena_alloc(struct arena *arena, size_t size)
+{
+  struct arena_block *block = arena->block;
+  void *ptr;
+
+  size = (size + 7) & ~(size_t)7;
+  if (!block || block->used + size > block->size) {
+    size_t block_size = block ? block->size * 2 : ARENA_BLOCK_SIZE;
+    while (block_size < size)
+      block_size *= 2;
+    block = malloc(sizeof *block + block_size);
+    block->prev = arena->block;
+    block->size = block_size;
+    block->used = 0;
+    arena->block = block;
+  }
+  ptr = block->data + block->used;
+  block->used += size;
+  return ptr;
+}
+
+static void
+arena_fini(struct arena *arena)
+{
+  struct arena_block *block, *prev;
+
+  for (block = arena->block; block; block = prev) {
+    prev = block->prev;
+    free(block);
+  }
+  arena->block = NULL;
+}
+
+/* Free everything allocated from the arena. If the frame did not fit in one
+ * block, replace them all with a single block as big as all of them
+ * together, so the same frame fits in it next time. */
+static void
+arena_reset(struct arena *arena)
+{
+  struct arena_block *block = arena->block;
+
+  if (!block)
+    return;
+  if (block->prev) {
+    size_t size = 0;
+    for (; block; block = block->prev)
+      size += block->size;
+    arena_fini(arena);
+    block = malloc(sizeof *block + size);
+    block->prev = NULL;
+    block->size = size;
+    arena->block = block;
+  }
+  block->used = 0;
+}
+
+/* Buffers are recycled instead of destroyed, and keep their allocations.
+ * The pool grows to hold every buffer a frame has used at once, so that
+ * the next frame finds them all here. */
+struct buffer_pool {
+  hb_buffer_t **buffers;
+  unsigned int count;
+  unsigned int size;
+};
+
+static __thread struct buffer_pool buffer_pool;
+
+static hb_buffer_t *
+buffer_pool_get(void)
+{
+  if (buffer_pool.count > 0)
+    return buffer_pool.buffers[--buffer_pool.count];
+  return hb_buffer_create ();
+}
+
+static void
+buffer_pool_put(hb_buffer_t *buffer)
+{
+  if (buffer_pool.count == buffer_pool.size) {
+    unsigned int size = buffer_pool.size ? buffer_pool.size * 2 :
+      BUFFER_POOL_SIZE;
+    hb_buffer_t **buffers = realloc(buffer_pool.buffers,
+        size * sizeof *buffers);
+    if (!buffers) {
+      hb_buffer_destroy (buffer);
+      return;
+    }
+    buffer_pool.buffers = buffers;
+    buffer_pool.size = size;
+  }
+  hb_buffer_clear_contents (buffer);
+  buffer_pool.buffers[buffer_pool.count++] = buffer;
+}
+
+static void
+buffer_pool_fini(void)
+{
+  while (buffer_pool.count > 0)
+    hb_buffer_destroy (buffer_pool.buffers[--buffer_pool.count]);
+  free(buffer_pool.buffers);
+  buffer_pool.buffers = NULL;
+  buffer_pool.size = 0;
+}
+
+/* A run of text with a single script, direction and bidi level. */
+struct text_run {
+  unsigned int offset;  /* in bytes, into the text */
+  unsigned int length;  /* in bytes */
+  hb_script_t script;
+  hb_direction_t direction;
+  unsigned int level;
+};
+
+/* Itemized text. Runs are stored in visual (left to right) order, followed
+ * by a copy of the text. */
+struct text_layout {
+  size_t capacity;  /* allocated size, in bytes */
+  uint32_t hash;
+  char *text;
+  unsigned int text_len;
+  hb_direction_t direction;  /* paragraph direction */
+  unsigned int num_runs;
+  struct text_run runs[];
+};
+
+/* Simplified bidi classes. Enough to handle mixed LTR/RTL text with digits
+ * in a single paragraph, without explicit embeddings. */
+enum bidi_class {
+  BIDI_L,   /* strong left to right */
+  BIDI_R,   /* strong right to left */
+  BIDI_AL,  /* arabic letter */
+  BIDI_EN,  /* european number */
+  BIDI_AN,  /* arabic number */
+  BIDI_ES,  /* european number separator */
+  BIDI_ET,  /* european number terminator */
+  BIDI_CS,  /* common number separator */
+  BIDI_N,   /* neutral */
+};
+
+/* Layouts are cached per string, so redrawing skips the itemization. Each
+ * string has one slot, picked by its hash. A new string replaces the one in
+ * its slot, reusing its memory if it is big enough. Like the frame arena and
+ * buffer pool, each thread has its own cache, so no locking is needed. */
+static __thread struct text_layout *layout_cache[LAYOUT_CACHE_SIZE];
+
+static uint32_t
+hash_str(const char *str)
+{
+  /* FNV-1a */
+  uint32_t hash = 2166136261u;
+  while (*str)
+    hash = (hash ^ (uint8_t)*str++) * 16777619u;
+  return hash;
+}
+
+static int
+is_real_script(hb_script_t script)
+{
+  return script != HB_SCRIPT_COMMON &&
+    script != HB_SCRIPT_INHERITED &&
+    script != HB_SCRIPT_UNKNOWN;
+}
+
+static enum bidi_class
+get_bidi_class(hb_codepoint_t cp, hb_script_t script)
+{
+  /* Numbers and number punctuation, by code point: the script doesn't say
+   * whether digits are european or arabic numbers. */
+  if ((cp >= '0' && cp <= '9') || (cp >= 0x06F0 && cp <= 0x06F9) ||
+      (cp >= 0x2070 && cp <= 0x2079 && cp != 0x2071 && cp != 0x2072 &&
+       cp != 0x2073) || (cp >= 0x2080 && cp <= 0x2089) ||
+      (cp >= 0xFF10 && cp <= 0xFF19) ||
+      cp == 0x00B2 || cp == 0x00B3 || cp == 0x00B9)
+    return BIDI_EN;
+  if ((cp >= 0x0600 && cp <= 0x0605) || (cp >= 0x0660 && cp <= 0x0669) ||
+      cp == 0x066B || cp == 0x066C || cp == 0x06DD || cp == 0x08E2)
+    return BIDI_AN;
+  switch (cp) {
+  case '+': case '-': case 0x207A: case 0x207B: case 0x208A: case 0x208B:
+  case 0x2212: case 0xFB29: case 0xFE62: case 0xFE63: case 0xFF0B:
+  case 0xFF0D:
+    return BIDI_ES;
+  case '#': case '$': case '%': case 0x00B0: case 0x00B1: case 0x0609:
+  case 0x060A: case 0x066A: case 0x2030: case 0x2031: case 0x2032:
+  case 0x2033: case 0x2034: case 0x2035: case 0xFE5F: case 0xFE69:
+  case 0xFE6A: case 0xFF03: case 0xFF04: case 0xFF05:
+    return BIDI_ET;
+  case ',': case '.': case '/': case ':': case 0x00A0: case 0x060C:
+  case 0x202F: case 0x2044: case 0xFE50: case 0xFE52: case 0xFE55:
+  case 0xFF0C: case 0xFF0E: case 0xFF0F: case 0xFF1A:
+    return BIDI_CS;
+  }
+  /* currency symbols */
+  if ((cp >= 0x00A2 && cp <= 0x00A5) || (cp >= 0x20A0 && cp <= 0x20CF))
+    return BIDI_ET;
+
+  if (!is_real_script(script))
+    return BIDI_N;
+  if (script == HB_SCRIPT_ARABIC || script == HB_SCRIPT_SYRIAC ||
+      script == HB_SCRIPT_THAANA)
+    return BIDI_AL;
+  if (hb_script_get_horizontal_direction (script) == HB_DIRECTION_RTL)
+    return BIDI_R;
+  return BIDI_L;
+}
+
+/* Reverse any sequence of runs at or above each level, from the highest
+ * level down to the lowest odd level (UAX #9, L2). */
+static void
+reorder_runs(struct text_run *runs, unsigned int num_runs)
+{
+  unsigned int max_level = 0, min_odd_level = UINT32_MAX;
+
+  for (unsigned int i = 0; i < num_runs; i++) {
+    if (runs[i].level > max_level)
+      max_level = runs[i].level;
+    if ((runs[i].level & 1) && runs[i].level < min_odd_level)
+      min_odd_level = runs[i].level;
+  }
+
+  for (unsigned int level = max_level;
+      level >= min_odd_level && level > 0; level--) {
+    for (unsigned int i = 0; i < num_runs; ) {
+      if (runs[i].level < level) {
+        i++;
+        continue;
+      }
+      unsigned int end = i;
+      while (end < num_runs && runs[end].level >= level)
+        end++;
+      for (unsigned int a = i, b = end - 1; a < b; a++, b--) {
+        struct text_run tmp = runs[a];
+        runs[a] = runs[b];
+        runs[b] = tmp;
+      }
+      i = end;
+    }
+  }
+}
+
+/* Split text into runs of the same script and bidi level, and store them in
+ * the cache slot. */
+static struct text_layout *
+itemize_text(const char *text, uint32_t hash, struct text_layout **slot)
+{
+  hb_unicode_funcs_t *ufuncs = hb_unicode_funcs_get_default ();
+  unsigned int text_len = strlen(text);
+
+  /* Let HarfBuzz decode the UTF-8. Before shaping, each info holds the
+   * character in codepoint and its byte offset in cluster. */
+  hb_buffer_t *chars = buffer_pool_get ();
+  hb_buffer_add_utf8 (chars, text, text_len, 0, text_len);
+  unsigned int len = hb_buffer_get_length (chars);
+  hb_glyph_info_t *info = hb_buffer_get_glyph_infos (chars, NULL);
+
+  hb_script_t *scripts = arena_alloc(&frame_arena, len * sizeof *scripts);
+  uint8_t *classes = arena_alloc(&frame_arena, len * sizeof *classes);
+  unsigned int *levels = arena_alloc(&frame_arena, len * sizeof *levels);
+
+  hb_script_t last_script = HB_SCRIPT_COMMON;
+  for (unsigned int i = 0; i < len; i++) {
+    scripts[i] = hb_unicode_script (ufuncs, info[i].codepoint);
+    classes[i] = get_bidi_class(info[i].codepoint, scripts[i]);
+    /* combining marks take the class of their base (W1) */
+    if (scripts[i] == HB_SCRIPT_INHERITED && i > 0)
+      classes[i] = classes[i - 1];
+    if (is_real_script(scripts[i]) && !is_real_script(last_script))
+      /* leading common characters take the first real script */
+      for (unsigned int j = 0; j < i; j++)
+        scripts[j] = scripts[i];
+    if (is_real_script(scripts[i]))
+      last_script = scripts[i];
+    else
+      scripts[i] = last_script;
+  }
+
+  /* Paragraph level from the first strong character (P2, P3). */
+  unsigned int para_level = 0;
+  for (unsigned int i = 0; i < len; i++) {
+    if (classes[i] == BIDI_L || classes[i] == BIDI_R ||
+        classes[i] == BIDI_AL) {
+      para_level = classes[i] != BIDI_L;
+      break;
+    }
+  }
+  enum bidi_class para_class = para_level ? BIDI_R : BIDI_L;
+
+  /* European numbers after an arabic letter are arabic numbers (W2), and
+   * arabic letters are then just R (W3). */
+  enum bidi_class last_strong = para_class;
+  for (unsigned int i = 0; i < len; i++) {
+    if (classes[i] == BIDI_L || classes[i] == BIDI_R ||
+        classes[i] == BIDI_AL)
+      last_strong = classes[i];
+    else if (classes[i] == BIDI_EN && last_strong == BIDI_AL)
+      classes[i] = BIDI_AN;
+  }
+  for (unsigned int i = 0; i < len; i++)
+    if (classes[i] == BIDI_AL)
+      classes[i] = BIDI_R;
+
+  /* A single separator between two numbers of the same type joins them
+   * (W4), terminators next to european numbers become part of them (W5),
+   * and any other separators and terminators are neutral (W6). */
+  for (unsigned int i = 1; i + 1 < len; i++) {
+    enum bidi_class before = classes[i - 1], after = classes[i + 1];
+    if (classes[i] == BIDI_ES && before == BIDI_EN && after == BIDI_EN)
+      classes[i] = BIDI_EN;
+    else if (classes[i] == BIDI_CS && before == after &&
+        (before == BIDI_EN || before == BIDI_AN))
+      classes[i] = before;
+  }
+  for (unsigned int i = 0; i < len; ) {
+    if (classes[i] != BIDI_ET) {
+      i++;
+      continue;
+    }
+    unsigned int end = i;
+    while (end < len && classes[end] == BIDI_ET)
+      end++;
+    if ((i > 0 && classes[i - 1] == BIDI_EN) ||
+        (end < len && classes[end] == BIDI_EN))
+      for (; i < end; i++)
+        classes[i] = BIDI_EN;
+    i = end;
+  }
+  for (unsigned int i = 0; i < len; i++)
+    if (classes[i] == BIDI_ES || classes[i] == BIDI_ET ||
+        classes[i] == BIDI_CS)
+      classes[i] = BIDI_N;
+
+  /* Numbers after strong L are L (W7). */
+  last_strong = para_class;
+  for (unsigned int i = 0; i < len; i++) {
+    if (classes[i] == BIDI_L || classes[i] == BIDI_R)
+      last_strong = classes[i];
+    else if (classes[i] == BIDI_EN && last_strong == BIDI_L)
+      classes[i] = BIDI_L;
+  }
+
+  /* Neutrals between two of the same direction take that direction,
+   * otherwise the paragraph direction (N1, N2). Numbers count as R. */
+  for (unsigned int i = 0; i < len; ) {
+    if (classes[i] != BIDI_N) {
+      i++;
+      continue;
+    }
+    unsigned int end = i;
+    while (end < len && classes[end] == BIDI_N)
+      end++;
+    enum bidi_class before = i > 0 ? classes[i - 1] : para_class;
+    enum bidi_class after = end < len ? classes[end] : para_class;
+    if (before != BIDI_L) before = BIDI_R;
+    if (after != BIDI_L) after = BIDI_R;
+    for (; i < end; i++)
+      classes[i] = before == after ? before : para_class;
+  }
+
+  /* Resolve levels (I1, I2). */
+  for (unsigned int i = 0; i < len; i++) {
+    switch (classes[i]) {
+    case BIDI_L:
+      levels[i] = para_level + (para_level & 1);
+      break;
+    case BIDI_R:
+      levels[i] = para_level + !(para_level & 1);
+      break;
+    default:
+      levels[i] = para_level + 1 + !(para_level & 1);
+    }
+  }
+
+  /* Count and fill in the runs. */
+  unsigned int num_runs = 0;
+  for (unsigned int i = 0; i < len; i++)
+    if (i == 0 || levels[i] != levels[i - 1] || scripts[i] != scripts[i - 1])
+      num_runs++;
+
+  size_t size = sizeof (struct text_layout) +
+    num_runs * sizeof (struct text_run) + text_len + 1;
+  struct text_layout *layout = *slot;
+  if (!layout || layout->capacity < size) {
+    free(layout);
+    layout = malloc(size);
+    layout->capacity = size;
+    *slot = layout;
+  }
+  layout->hash = hash;
+  layout->text = (char *)&layout->runs[num_runs];
+  memcpy(layout->text, text, text_len + 1);
+  layout->text_len = text_len;
+  layout->direction = para_level ? HB_DIRECTION_RTL : HB_DIRECTION_LTR;
+  layout->num_runs = num_runs;
+
+  struct text_run *runs = layout->runs;
+  unsigned int r = 0;
+  for (unsigned int i = 0; i < len; i++) {
+    if (i == 0 || levels[i] != levels[i - 1] || scripts[i] != scripts[i - 1]) {
+      if (i > 0)
+        runs[r - 1].length = info[i].cluster - runs[r - 1].offset;
+      runs[r].offset = info[i].cluster;
+      runs[r].script = scripts[i];
+      runs[r].level = levels[i];
+      runs[r].direction = levels[i] & 1 ? HB_DIRECTION_RTL : HB_DIRECTION_LTR;
+      r++;
+    }
+  }
+  if (num_runs > 0)
+    runs[num_runs - 1].length = text_len - runs[num_runs - 1].offset;
+
+  reorder_runs(layout->runs, num_runs);
+
+  buffer_pool_put (chars);
+  return layout;
+}
+
+/* Get the itemized layout for some text, from the cache if possible. The
+ * layout is only valid until the next call, which may replace it. */
+static struct text_layout *
+get_text_layout(const char *text)
+{
+  uint32_t hash = hash_str(text);
+  struct text_layout **slot = &layout_cache[hash % LAYOUT_CACHE_SIZE];
+  struct text_layout *layout = *slot;
+
+  if (layout && layout->hash == hash && !strcmp(layout->text, text))
+    return layout;
+
+  return itemize_text(text, hash, slot);
+}
+
+/* Free the calling thread's layout cache. */
+static void
+free_layout_cache(void)
+{
+  for (unsigned int i = 0; i < LAYOUT_CACHE_SIZE; i++) {
+    free(layout_cache[i]);
+    layout_cache[i] = NULL;
+  }
+}
+
+/* Shape each run into its own buffer, taken from the buffer pool. The
+ * buffers are independent of each other, so the runs could also be shaped
+ * in parallel. */
+static void
+shape_text_layout(hb_font_t *font, const struct text_layout *layout,
+    hb_buffer_t **buffers)
+{
+  for (unsigned int i = 0; i < layout->num_runs; i++) {
+    const struct text_run *run = &layout->runs[i];
+    hb_buffer_t *buffer = buffer_pool_get ();
+    /* pass the whole text, so shaping sees the context around the run */
+    hb_buffer_add_utf8 (buffer, layout->text, layout->text_len,
+        run->offset, run->length);
+    hb_buffer_set_direction (buffer, run->direction);
+    hb_buffer_set_script (buffer, run->script);
+    hb_buffer_set_language (buffer, hb_language_get_default ());
+    hb_shape (font, buffer, NULL, 0);
+    buffers[i] = buffer;
+  }
+}
+
+/* FreeType's default LCD filter weights, out of 256. */
+#define LCD_FILTER_0 0x08
+#define LCD_FILTER_1 0x4D
+#define LCD_FILTER_2 0x56
+
+/* Gamma lookup table, filled once by init_glyph_tables. */
+static uint8_t gamma_table[256];
+
+static void
+init_glyph_tables(double gamma)
+{
+  for (unsigned int i = 0; i < 256; i++)
+    gamma_table[i] = round(255 * pow(i / 255., 1 / gamma));
+}
+
+/* Glyphs uploaded to the server. Each glyph is rasterized, filtered and
+ * gamma corrected once, when it is first used. */
+struct glyph_cache {
+  xcb_connection_t *c;
+  FT_Face ft_face;
+  xcb_render_glyphset_t gsid;
+  xcb_render_pictformat_t format;
+  int lcd;
+  unsigned int num_glyphs;
+  uint8_t *loaded;
+};
+
+/* Filter 16 subpixels. src[s + k] is the subpixel under tap k of output
+ * subpixel s. The filter is plain 16 bit multiply-adds over a fixed size
+ * block, so that it vectorizes at -O2. The weights add up to 256, so the
+ * result fits in a byte. */
+static inline void
+lcd_filter_block(const uint8_t *restrict src, uint8_t *restrict dst)
+{
+  for (unsigned int s = 0; s < 16; s++)
+    dst[s] = (uint16_t)(LCD_FILTER_0 * src[s] +
+        LCD_FILTER_1 * src[s + 1] + LCD_FILTER_2 * src[s + 2] +
+        LCD_FILTER_1 * src[s + 3] + LCD_FILTER_0 * src[s + 4] + 128) >> 8;
+}
+
+/* Convert an unfiltered FT_PIXEL_MODE_LCD bitmap to ARGB32. The image is one
+ * pixel wider on each side than the bitmap, for the filter to spill into. */
+static void
+convert_lcd_bitmap(const FT_Bitmap *bitmap, xcb_render_glyphinfo_t *glyph,
+    uint32_t *pixels)
+{
+  unsigned int sub_width = glyph->width * 3;
+  /* filter whole blocks of 16 subpixels, past the end of the row if needed */
+  unsigned int filter_width = (sub_width + 15) & ~15u;
+  uint8_t *row = alloca(filter_width + 4);
+  uint8_t *filtered = alloca(filter_width);
+
+  memset(row, 0, filter_width + 4);
+  for (unsigned int y = 0; y < bitmap->rows; y++) {
+    /* row[s + k] is the source subpixel under tap k of output subpixel s */
+    memcpy(row + 5, bitmap->buffer + y * bitmap->pitch, bitmap->width);
+    for (unsigned int b = 0; b < filter_width; b += 16)
+      lcd_filter_block(row + b, filtered + b);
+    for (unsigned int s = 0; s < sub_width; s++)
+      filtered[s] = gamma_table[filtered[s]];
+    for (unsigned int x = 0; x < glyph->width; x++) {
+      uint32_t red = filtered[x * 3];
+      uint32_t green = filtered[x * 3 + 1];
+      uint32_t blue = filtered[x * 3 + 2];
+      /* like Xft, use green as the alpha for non component alpha use */
+      pixels[y * glyph->width + x] =
+        green << 24 | red << 16 | green << 8 | blue;
+    }
+  }
+}
+
+static void
+cache_glyph(struct glyph_cache *cache, hb_codepoint_t gid)
+{
+  xcb_connection_t *c = cache->c;
+  FT_Face ft_face = cache->ft_face;
+  FT_Error ft_error;
+  xcb_render_glyphinfo_t glyph;
+  xcb_void_cookie_t cookie;
+  uint32_t glyph_id = gid;
+  uint8_t *buf;
+  uint32_t buf_size;
+
+  if (gid >= cache->num_glyphs || cache->loaded[gid])
+    return;
+
+  /* load the glyph */
+  if (cache->lcd) {
+    ft_error = FT_Load_Glyph (ft_face, gid, FT_LOAD_TARGET_LCD);
+    if (!ft_error)
+      ft_error = FT_Render_Glyph (ft_face->glyph, FT_RENDER_MODE_LCD);
+  } else {
+    ft_error = FT_Load_Glyph (ft_face, gid, FT_LOAD_RENDER);
+  }
+  if (ft_error) {
+    printf("error loading glyph\n");
+    return;
+  }
+
+  FT_Bitmap *bitmap = &ft_face->glyph->bitmap;
+
+  printf("bitmap size=(%u,%u)\n",
+      bitmap->width, bitmap->rows);
+
+  /* copy into glyph data for xcb */
+  /* x and y are the glyph origin, relative to the image's top left */
+  glyph.height = bitmap->rows;
+  glyph.x = -ft_face->glyph->bitmap_left;
+  glyph.y = ft_face->glyph->bitmap_top;
+  glyph.x_off = 0;
+  glyph.y_off = 0;
+
+  if (cache->lcd) {
+    glyph.width = bitmap->width / 3 + 2;
+    glyph.x += 1;  /* the padding pixel */
+    buf_size = glyph.width * glyph.height * 4;
+    buf = alloca(buf_size);
+    convert_lcd_bitmap(bitmap, &glyph, (uint32_t *)buf);
+  } else {
+    glyph.width = bitmap->width;
+    /* scanlines are padded to 32 bits */
+    if (glyph.width & 3)
+      glyph.width += 4 - (glyph.width & 3);
+    buf_size = glyph.width * glyph.height;
+    buf = alloca(buf_size);
+    memset(buf, 0, buf_size);
+    for (unsigned int y = 0; y < bitmap->rows; y++)
+      for (unsigned int x = 0; x < bitmap->width; x++)
+        buf[y * glyph.width + x] =
+          gamma_table[bitmap->buffer[y * bitmap->pitch + x]];
+  }
+
+  cookie = xcb_render_add_glyphs_checked (c, cache->gsid, 1,
+      &glyph_id, &glyph, buf_size, buf);
+  testCookie(cookie, c, "can't add glyph");
+  cache->loaded[gid] = 1;
+}
+
+struct glyph_header {
+  uint8_t count;
+  uint8_t pad0[3];
+  int16_t dx, dy;
+};
+
+/* Shape text and encode it as glyph elements for CompositeGlyphs32, in a
+ * buffer from the frame arena, with the pen starting at (x, y) on the
+ * baseline. Glyphs are added to the glyph cache, if there is one. Returns
+ * the length of the encoded elements. */
+static uint32_t
+encode_text(hb_font_t *font, struct glyph_cache *cache, const char *text,
+    int origin_x, int origin_y, uint8_t **glyphitems)
+{
+  struct text_layout *layout = get_text_layout(text);
+  unsigned int num_runs = layout->num_runs;
+  hb_buffer_t **buffers = arena_alloc(&frame_arena,
+      num_runs * sizeof *buffers);
+  unsigned int total_len = 0;
+
+  shape_text_layout(font, layout, buffers);
+  for (unsigned int r = 0; r < num_runs; r++)
+    total_len += hb_buffer_get_length (buffers[r]);
+
+  uint8_t *glyphitems_buf = arena_alloc(&frame_arena,
+      total_len * (sizeof (uint32_t) + sizeof (struct glyph_header)));
+  uint32_t glyphitems_len = 0;
+
+  /* The pen moves by the advances only. Each glyph is drawn at the pen
+   * plus its offset, relative to where the previous glyph was drawn, since
+   * glyphs in the GlyphSet have no advance of their own. */
+  double pen_x = 0;
+  double pen_y = 0;
+  int last_x = 0;
+  int last_y = 0;
+  for (unsigned int r = 0; r < num_runs; r++)
+  {
+    unsigned int len = hb_buffer_get_length (buffers[r]);
+    hb_glyph_info_t *info = hb_buffer_get_glyph_infos (buffers[r], NULL);
+    hb_glyph_position_t *pos = hb_buffer_get_glyph_positions (buffers[r], NULL);
+    for (unsigned int i = 0; i < len; i++)
+    {
+      if (cache)
+        cache_glyph(cache, info[i].codepoint);
+
+      /* HarfBuzz's y axis points up, X's points down */
+      int x = origin_x + round(pen_x + pos[i].x_offset / 64.);
+      int y = origin_y + round(-(pen_y + pos[i].y_offset / 64.));
+      struct glyph_header glyph_header = {
+        .count = 1,
+        .dx = x - last_x,
+        .dy = y - last_y,
+      };
+      last_x = x;
+      last_y = y;
+      memcpy(glyphitems_buf + glyphitems_len, &glyph_header, sizeof glyph_header);
+      glyphitems_len += sizeof(struct glyph_header);
+      uint32_t glyph_id = info[i].codepoint;
+      memcpy(glyphitems_buf + glyphitems_len, &glyph_id, sizeof glyph_id);
+      glyphitems_len += sizeof glyph_id;
+
+      pen_x += pos[i].x_advance / 64.;
+      pen_y += pos[i].y_advance / 64.;
+    }
+    buffer_pool_put (buffers[r]);
+  }
+
+  *glyphitems = glyphitems_buf;
+  return glyphitems_len;
+}
+
+/* Where draw_text composites the text, with the pen starting at (x, y). */
+struct text_target {
+  xcb_connection_t *c;
+  xcb_render_picture_t src;
+  xcb_render_picture_t dst;
+  struct glyph_cache *cache;
+  int x, y;
+};
+
+/* Draw one string as a frame: reset the frame arena, encode the text and
+ * composite it. The request is unchecked, so drawing does not wait for the
+ * server; errors arrive in the event loop. Without a target, the text is
+ * only encoded. Returns the length of the encoded glyph elements. */
+static uint32_t
+draw_text(hb_font_t *font, const struct text_target *target, const char *text)
+{
+  uint8_t *glyphitems;
+  uint32_t glyphitems_len;
+
+  arena_reset(&frame_arena);
+  if (!target)
+    return encode_text(font, NULL, text, 0, 0, &glyphitems);
+
+  glyphitems_len = encode_text(font, target->cache, text,
+      target->x, target->y, &glyphitems);
+  xcb_render_composite_glyphs_32 (target->c, XCB_RENDER_PICT_OP_OVER,
+      target->src, target->dst, target->cache->format, target->cache->gsid,
+      0, 0, glyphitems_len, glyphitems);
+  return glyphitems_len;
+}
+
+/* Draw the same string over and over, and report how long it took and how
+ * many heap allocations the whole process made. Without a target (no
+ * display), this only measures encoding. */
+static void
+run_benchmark(hb_font_t *font, const struct text_target *target,
+    const char *text)
+{
+  uint32_t glyphitems_len = 0;
+
+  /* Warm up the caches and the arena, until a frame stops allocating. */
+  unsigned long allocs = 0;
+  for (unsigned int i = 0; i < BENCH_WARMUP; i++) {
+    unsigned long before = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+    draw_text(font, target, text);
+    allocs = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+    if (i > 0 && allocs == before)
+      break;
+  }
+
+  clock_t start = clock();
+  for (unsigned int i = 0; i < BENCH_ITERATIONS; i++)
+    glyphitems_len += draw_text(font, target, text);
+  allocs = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED) - allocs;
+  if (target) {
+    /* wait for the server to catch up; the reply is not counted */
+    free(xcb_get_input_focus_reply (target->c,
+          xcb_get_input_focus (target->c), NULL));
+  }
+  double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+  printf("path: %s\n", target ? "encode and composite" :
+      "encode only (no display)");
+  printf("strings: %u\n", BENCH_ITERATIONS);
+  printf("time: %g s (%g us/string)\n", seconds,
+      seconds * 1e6 / BENCH_ITERATIONS);
+  printf("glyph elements: %u bytes/string\n",
+      glyphitems_len / BENCH_ITERATIONS);
+#ifdef HAVE_ALLOC_COUNT
+  printf("heap allocations: %lu (%g/string)\n", allocs,
+      (double)allocs / BENCH_ITERATIONS);
+#else
+  printf("heap allocations: not counted, build with -DCOUNT_ALLOCS on glibc\n");
+#endif
+}
+
 int
 main(int argc, char **argv)
 {
   const char *fontfile;
   const char *text;
+  int lcd = 0;
+  int bench = 0;
+
+  /* -l: subpixel (LCD) rendering, -b: benchmark, without drawing */
+  for (; argc > 1 && argv[1][0] == '-'; argc--, argv++)
+  {
+    if (!strcmp(argv[1], "-l"))
+      lcd = 1;
+    else if (!strcmp(argv[1], "-b"))
+      bench = 1;
+    else
+      break;
+  }
 
   if (argc < 3)
   {
-    fprintf (stderr, "usage: hello-harfbuzz font-file.ttf text\n");
+    fprintf (stderr, "usage: hello-harfbuzz [-l] [-b] font-file.ttf text\n");
     exit (1);
   }
 
   fontfile = argv[1];
   text = argv[2];
 
+  init_glyph_tables (GLYPH_GAMMA);
+
   /* Initialize FreeType and create FreeType font face. */
   FT_Library ft_library;
   FT_Face ft_face;
@@ -92,6 +986,10 @@ main(int argc, char **argv)
     abort();
   if ((ft_error = FT_New_Face (ft_library, fontfile, 0, &ft_face)))
     abort();
+  /* LCD bitmaps are filtered with our own tables, so turn off FreeType's
+   * filter. This fails if FreeType only has Harmony rendering, which does
+   * not filter anyway. */
+  FT_Library_SetLcdFilter (ft_library, FT_LCD_FILTER_NONE);
   if ((ft_error = FT_Set_Char_Size (ft_face, FONT_SIZE*64, FONT_SIZE*64, 0, 0)))
     abort();
 
@@ -99,74 +997,73 @@ main(int argc, char **argv)
   hb_font_t *hb_font;
   hb_font = hb_ft_font_create (ft_face, NULL);
 
-  /* Create hb-buffer and populate. */
-  hb_buffer_t *hb_buffer;
-  hb_buffer = hb_buffer_create ();
-  hb_buffer_add_utf8 (hb_buffer, text, -1, 0, -1);
-  hb_buffer_guess_segment_properties (hb_buffer);
+  /* Split the text into runs, and shape each run in its own buffer. */
+  struct text_layout *layout = get_text_layout (text);
+  hb_buffer_t **hb_buffers = alloca (layout->num_runs * sizeof *hb_buffers);
+  shape_text_layout (hb_font, layout, hb_buffers);
 
-  /* Shape it! */
-  hb_shape (hb_font, hb_buffer, NULL, 0);
-
-  /* Get glyph information and positions out of the buffer. */
-  unsigned int len = hb_buffer_get_length (hb_buffer);
-  hb_glyph_info_t *info = hb_buffer_get_glyph_infos (hb_buffer, NULL);
-  hb_glyph_position_t *pos = hb_buffer_get_glyph_positions (hb_buffer, NULL);
+  unsigned int num_runs = layout->num_runs;
+  unsigned int total_len = 0;
 
   /* Print them out as is. */
   printf ("Raw buffer contents:\n");
-  for (unsigned int i = 0; i < len; i++)
+  for (unsigned int r = 0; r < num_runs; r++)
   {
-    hb_codepoint_t gid   = info[i].codepoint;
-    unsigned int cluster = info[i].cluster;
-    double x_advance = pos[i].x_advance / 64.;
-    double y_advance = pos[i].y_advance / 64.;
-    double x_offset  = pos[i].x_offset / 64.;
-    double y_offset  = pos[i].y_offset / 64.;
+    /* Get glyph information and positions out of the buffer. */
+    unsigned int len = hb_buffer_get_length (hb_buffers[r]);
+    hb_glyph_info_t *info = hb_buffer_get_glyph_infos (hb_buffers[r], NULL);
+    hb_glyph_position_t *pos = hb_buffer_get_glyph_positions (hb_buffers[r], NULL);
+    total_len += len;
 
-    char glyphname[32];
-    hb_font_get_glyph_name (hb_font, gid, glyphname, sizeof (glyphname));
+    printf ("run %u: level=%u direction=%s\n", r, layout->runs[r].level,
+        hb_direction_to_string (layout->runs[r].direction));
 
-    printf ("glyph='%s'	cluster=%d	advance=(%g,%g)	offset=(%g,%g)\n",
-            glyphname, cluster, x_advance, y_advance, x_offset, y_offset);
-  }
-
-  printf ("Converted to absolute positions:\n");
-  /* And converted to absolute positions. */
-  if (0) {
-    double current_x = 0;
-    double current_y = 0;
     for (unsigned int i = 0; i < len; i++)
     {
       hb_codepoint_t gid   = info[i].codepoint;
       unsigned int cluster = info[i].cluster;
-      double x_position = current_x + pos[i].x_offset / 64.;
-      double y_position = current_y + pos[i].y_offset / 64.;
+      double x_advance = pos[i].x_advance / 64.;
+      double y_advance = pos[i].y_advance / 64.;
+      double x_offset  = pos[i].x_offset / 64.;
+      double y_offset  = pos[i].y_offset / 64.;
 
       char glyphname[32];
       hb_font_get_glyph_name (hb_font, gid, glyphname, sizeof (glyphname));
 
-      printf ("glyph='%s'	cluster=%d	position=(%g,%g)\n",
-          glyphname, cluster, x_position, y_position);
-
-      current_x += pos[i].x_advance / 64.;
-      current_y += pos[i].y_advance / 64.;
+      printf ("glyph='%s'	cluster=%d	advance=(%g,%g)	offset=(%g,%g)\n",
+              glyphname, cluster, x_advance, y_advance, x_offset, y_offset);
     }
   }
 
   /* Draw, using xcb. */
   double width = 2 * MARGIN;
   double height = 2 * MARGIN;
-  for (unsigned int i = 0; i < len; i++)
+  for (unsigned int r = 0; r < num_runs; r++)
   {
-    width  += pos[i].x_advance / 64.;
-    height -= pos[i].y_advance / 64.;
+    unsigned int len = hb_buffer_get_length (hb_buffers[r]);
+    hb_glyph_position_t *pos = hb_buffer_get_glyph_positions (hb_buffers[r], NULL);
+    for (unsigned int i = 0; i < len; i++)
+    {
+      width  += pos[i].x_advance / 64.;
+      height -= pos[i].y_advance / 64.;
+    }
   }
-  if (HB_DIRECTION_IS_HORIZONTAL (hb_buffer_get_direction(hb_buffer)))
+  /* runs of either direction share the line */
+  if (HB_DIRECTION_IS_HORIZONTAL (layout->direction))
     height += FONT_SIZE;
   else
     width  += FONT_SIZE;
 
+  /* Set up baseline, centered in a FONT_SIZE line like the cairo version. */
+  FT_Size_Metrics *metrics = &ft_face->size->metrics;
+  double ascent = metrics->ascender / 64.;
+  double font_height = (metrics->ascender - metrics->descender) / 64.;
+  int origin_x = round(MARGIN);
+  int origin_y = round(MARGIN + (FONT_SIZE - font_height) * .5 + ascent);
+
+  for (unsigned int r = 0; r < num_runs; r++)
+    buffer_pool_put (hb_buffers[r]);
+
 
   xcb_connection_t    *c;
   xcb_screen_t        *screen;
@@ -179,6 +1076,15 @@ main(int argc, char **argv)
   uint32_t             values[2];
 
   c = xcb_connect (NULL, NULL);
+  if (xcb_connection_has_error (c)) {
+    xcb_disconnect (c);
+    if (bench) {
+      run_benchmark (hb_font, NULL, text);
+      goto done;
+    }
+    printf("can't connect to the display\n");
+    return 1;
+  }
 
   /* get the first screen */
   screen = xcb_setup_roots_iterator (xcb_get_setup (c)).data;
@@ -203,8 +1109,8 @@ main(int argc, char **argv)
   xcb_rectangle_t window_rect = {
     .x = 0,
     .y = 0,
-    .width = 350,
-    .height = 60
+    .width = ceil(width),
+    .height = ceil(height)
   };
 
   /* create the window */
@@ -296,7 +1202,7 @@ skip_hint:
       version->major_version, version->minor_version);
   free(version);
 
-  xcb_render_glyphset_t gsid;
+  struct glyph_cache glyph_cache;
   xcb_render_pictformat_t format, window_format;
   xcb_render_pictforminfo_t *formats;
 
@@ -344,6 +1250,28 @@ skip_hint:
 
   alpha_mask_format = alpha_forminfo_ptr->id;
 
+  /* For LCD text, use the a8r8g8b8 format, for component alpha. Its layout
+   * has to match what convert_lcd_bitmap writes. get_pictforminfo only
+   * compares masks, so check the shifts here as well. */
+  xcb_render_pictformat_t argb_format = 0;
+
+  if (lcd) {
+    for (unsigned int i = 0; i < formats_reply->num_formats; i++) {
+      xcb_render_directformat_t *direct = &formats[i].direct;
+      if (formats[i].type == XCB_RENDER_PICT_TYPE_DIRECT &&
+          formats[i].depth == 32 &&
+          direct->alpha_mask == 255 && direct->alpha_shift == 24 &&
+          direct->red_mask == 255 && direct->red_shift == 16 &&
+          direct->green_mask == 255 && direct->green_shift == 8 &&
+          direct->blue_mask == 255 && direct->blue_shift == 0) {
+        argb_format = formats[i].id;
+        break;
+      }
+    }
+    if (!argb_format)
+      printf("no ARGB32 format, not using LCD rendering\n");
+  }
+
   free(formats_reply);
 
   /*
@@ -356,8 +1284,15 @@ skip_hint:
   */
 
 
-  gsid = xcb_generate_id (c);
-  cookie = xcb_render_create_glyph_set_checked (c, gsid, alpha_mask_format);
+  glyph_cache.c = c;
+  glyph_cache.ft_face = ft_face;
+  glyph_cache.lcd = argb_format != 0;
+  glyph_cache.format = glyph_cache.lcd ? argb_format : alpha_mask_format;
+  glyph_cache.num_glyphs = ft_face->num_glyphs;
+  glyph_cache.loaded = calloc(glyph_cache.num_glyphs, 1);
+  glyph_cache.gsid = xcb_generate_id (c);
+  cookie = xcb_render_create_glyph_set_checked (c, glyph_cache.gsid,
+      glyph_cache.format);
   testCookie(cookie, c, "can't create glyph set");
 
   /* Set up cairo font face. */
@@ -368,86 +1303,6 @@ skip_hint:
   cairo_set_font_size (cr, FONT_SIZE);
   */
 
-  xcb_render_glyphinfo_t glyph;
-  uint32_t glyph_id;
-  uint8_t *buf;
-  uint32_t buf_size;
-
-  for (unsigned int i = 0; i < len; i++)
-  {
-    /* convert character code to glyph index? */
-    // glyph_index = FT_Get_Char_Index( face, info[i].codepoint );
-
-    hb_codepoint_t gid = info[i].codepoint;
-    char glyphname[32];
-    hb_font_get_glyph_name (hb_font, gid, glyphname, sizeof (glyphname));
-
-    // printf ("%u. glyph='%s'\n", i, glyphname);
-
-    /* load the glyph */
-    ft_error = FT_Load_Glyph (ft_face, info[i].codepoint, FT_LOAD_RENDER);
-    if (ft_error) {
-      printf("error loading glyph\n");
-      continue;
-    }
-
-    FT_GlyphSlot slot = ft_face->glyph;
-    FT_Bitmap *bitmap = &slot->bitmap;
-
-    printf("bitmap size=(%u,%u)\n",
-        bitmap->width, bitmap->rows);
-
-    /* copy into glyph data for xcb */
-    glyph.width = bitmap->width;
-    glyph.height = bitmap->rows;
-    glyph.x = 0;
-    glyph.y = glyph.height - FONT_SIZE; /* negative? 0? */
-    glyph.x_off = 0; // pos[i].x_advance / 64.;
-    glyph.y_off = 0; // pos[i].y_advance / 64.;
-    glyph_id = info[i].codepoint;
-
-    if (glyph.width & 3)
-      glyph.width += 4 - (glyph.width & 3);
-    if (glyph.height & 3)
-      glyph.height += 4 - (glyph.height & 3);
-
-    buf_size = glyph.width * glyph.height;
-    buf = alloca(buf_size);
-    memset(buf, 0, buf_size);
-    uint8_t *bitmap_buf = bitmap->buffer;
-    int8_t orig_width = bitmap->width;
-    int8_t orig_height = bitmap->rows;
-    for (unsigned int y = 0; y < orig_height; y++)
-      for (unsigned int x = 0; x < orig_width; x++)
-        buf[y * glyph.width + x] = bitmap->buffer[y * orig_width + x];
-    /*
-    memset(buf, 0x44, buf_size);
-    */
-    /*
-    if (buf_size & 3)
-      buf_size += 4 - (buf_size & 3);
-    if ((size_t)buf & 3)
-      buf += 4 - ((size_t)buf & 3);
-      */
-    /*
-     * more bitmap properties:
-    int             pitch;
-    unsigned char*  buffer;
-    unsigned short  num_grays; // should be 256
-    unsigned char   pixel_mode; // should be FT_PIXEL_MODE_GRAY
-    unsigned char   palette_mode;
-    void*           palette;
-    */
-
-    cookie = xcb_render_add_glyphs_checked (c, gsid, 1,
-        &glyph_id, &glyph, buf_size, buf);
-    testCookie(cookie, c, "can't add glyph");
-/*
-    xcb_render_add_glyphs (c, gsid, 1, &glyph_id, &glyph, buf_size, buf);
-*/
-  }
-
-
   /* Set up baseline. */
     /*
   if (HB_DIRECTION_IS_HORIZONTAL (hb_buffer_get_direction(hb_buffer)))
@@ -464,48 +1319,9 @@ skip_hint:
   */
 
 
-  struct glyph_header {
-    uint8_t count;
-    uint8_t pad0[3];
-    int16_t dx, dy;
-  } *glyph_header;
-
-  uint8_t *glyphitems_buf;
-  uint32_t glyphitems_len = 0;
-
-  glyphitems_buf = alloca(len * (1 + sizeof *glyph_header));
-
     /*
-  cairo_glyph_t *cairo_glyphs = cairo_glyph_allocate (len);
+  cairo_glyph_t *cairo_glyphs = cairo_glyph_allocate (total_len);
   */
-  double current_x = 0;
-  double current_y = 0;
-  for (unsigned int i = 0; i < len; i++)
-  {
-    double x_position = current_x + pos[i].x_offset / 64.;
-    double y_position = current_y + pos[i].y_offset / 64.;
-    double dx = round(x_position + pos[i].x_offset / 64.);
-    double dy = round(-y_position + pos[i].y_offset / 64.);
-    struct glyph_header glyph_header = {
-      .count = 1,
-      .dx = dx,
-      .dy = dy,
-    };
-    current_x -= dx;
-    current_y -= dy;
-    memcpy(glyphitems_buf + glyphitems_len, &glyph_header, sizeof glyph_header);
-    glyphitems_len += sizeof(struct glyph_header);
-    glyphitems_buf[glyphitems_len] = info[i].codepoint;
-    glyphitems_len += 4;
-
-    current_x += pos[i].x_advance / 64.;
-    current_y += pos[i].y_advance / 64.;
-
-    /*
-    if (glyphitems_len & 3)
-      glyphitems_len += 4 - (glyphitems_len & 3);
-      */
-  }
 
   /* create picture to composite into */
   xcb_render_picture_t window_pict = xcb_generate_id(c);
@@ -533,12 +1349,22 @@ skip_hint:
       src_pic, glyphs_color, 1, &window_rect);
   testCookie(cookie, c, "can't fill rectangle");
 
-  int16_t src_x = 0;
-  int16_t src_y = 0;
-
   /* composite the glyphs */
+  struct text_target target = {
+    .c = c,
+    .src = src_pic,
+    .dst = window_pict,
+    .cache = &glyph_cache,
+    .x = origin_x,
+    .y = origin_y,
+  };
 
   xcb_flush(c);
+
+  if (bench) {
+    run_benchmark (hb_font, &target, text);
+    goto endloop;
+  }
   /*
 Errors:
 Picture, PictOp, PictFormat, GlyphSet, Glyph
@@ -552,10 +1378,7 @@ Picture, PictOp, PictFormat, GlyphSet, Glyph
   xcb_generic_error_t *err = (xcb_generic_error_t *)e;
     switch (e->response_type & ~0x80) {
     case XCB_EXPOSE:
-      cookie = xcb_render_composite_glyphs_8_checked (c,
-          XCB_RENDER_PICT_OP_ADD, src_pic, window_pict, 0, gsid,
-          src_x, src_y, glyphitems_len, glyphitems_buf);
-      testCookie(cookie, c, "can't composite glyphs");
+      draw_text (hb_font, &target, text);
       xcb_flush (c);
       break;
     case XCB_KEY_PRESS: {
@@ -586,10 +1409,14 @@ Picture, PictOp, PictFormat, GlyphSet, Glyph
   */
   xcb_free_gc (c, foreground);
   xcb_free_gc (c, background);
-  xcb_render_free_glyph_set (c, gsid);
+  xcb_render_free_glyph_set (c, glyph_cache.gsid);
+  free(glyph_cache.loaded);
   xcb_disconnect (c);
 
-  hb_buffer_destroy (hb_buffer);
+done:
+  buffer_pool_fini ();
+  arena_fini (&frame_arena);
+  free_layout_cache ();
   hb_font_destroy (hb_font);
 
   FT_Done_Face (ft_face);